@@ -3,22 +3,46 @@
  * Name = Ben Shaughnessy
  * Email = bshaughn@hawk.iit.edu
  */
+#define _GNU_SOURCE         /* memmem */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
 #include <signal.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <termios.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <stdint.h>
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
+#define MAXARGS    1024   /* initial size of argv, grown as needed */
 #define MAXJOBS      16   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
+#define MAXSUBST  1<<20   /* max bytes captured by one $(...) */
+#define SUBSTCHUNK 1<<16  /* initial size of a $(...) capture buffer */
+#define MAXEXPAND  (MAXLINE + (MAXSUBST)) /* max size of an expanded line */
+#define SUBSTSPECIAL "|<>&'" /* kept literal when they come from a $(...) */
+#define DIRBUFSZ  1<<18   /* bytes fetched by each getdents64 call */
+#define GLOBCHUNK 1<<20   /* size of each block of globbed words */
+#define MAXDCACHE     8   /* directory listings kept during one line */
+#define MAXPATHDIRS  64   /* PATH directories indexed for completion */
+#define MAXLISTED   200   /* completion candidates shown at once */
+#define MAXTRACE  1<<16   /* trace events kept in memory */
+#define MAXDEADLINES (4*MAXJOBS) /* pending entries in the deadline heap */
+#define KILLGRACE  2000   /* ms from SIGTERM to SIGKILL for a timed out job */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -48,8 +72,103 @@ struct job_t {              /* The job struct */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
     char cmdline[MAXLINE];  /* command line */
+    long long timeout;      /* time allowed in ms, 0 for none */
+    long long deadline;     /* when it runs out, ms on CLOCK_MONOTONIC */
+    int timedout;           /* 1 once sent SIGTERM, 2 once sent SIGKILL */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+
+/* Glob pattern token types */
+#define GT_LIT  0   /* run of literal bytes */
+#define GT_ONE  1   /* ? */
+#define GT_STAR 2   /* * */
+#define GT_SET  3   /* [...] */
+
+struct gtok_t {             /* One token of a compiled glob pattern */
+    int type;               /* GT_LIT, GT_ONE, GT_STAR or GT_SET */
+    const char *lit;        /* GT_LIT: start of the run */
+    size_t len;             /* GT_LIT: length of the run */
+    unsigned char set[32];  /* GT_SET: bitmap of the bytes it matches */
+};
+
+struct gpat_t {             /* A compiled path component of a glob */
+    int kind;               /* 0 literal, 1 pattern, 2 the ** globstar */
+    int dot;                /* may match names starting with '.' */
+    const char *head;       /* literal every match starts with */
+    size_t headlen;
+    const char *tail;       /* literal every match ends with */
+    size_t taillen;
+    struct gtok_t *tok;     /* tokens matched between head and tail */
+    int ntok;
+};
+
+struct dent_t {             /* One entry of a directory listing */
+    unsigned int off;       /* offset of the name in dlist_t.names */
+    unsigned short len;     /* length of the name */
+    unsigned char type;     /* d_type reported by getdents64 */
+};
+
+struct dlist_t {            /* A directory listing read with getdents64 */
+    unsigned long used;     /* LRU clock, 0 if the cache slot is empty */
+    int pins;               /* globwalk() frames iterating over it */
+    int valid;              /* may be reused while the mtime matches */
+    int heap;               /* not a cache slot, free when released */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;  /* directory mtime when it was read */
+    char *names;            /* NUL terminated names, back to back */
+    size_t nbytes, namecap;
+    struct dent_t *ents;
+    size_t nents, entcap;
+};
+struct dlist_t dcache[MAXDCACHE]; /* The glob directory cache */
+unsigned long dclock;       /* LRU clock for dcache */
+
+struct termios cooked;      /* terminal settings outside the line editor */
+int rawmode;                /* is the terminal in raw mode? */
+
+struct tnode_t {            /* A node of the executable name trie */
+    unsigned char c;        /* byte leading to this node */
+    unsigned long long dirs;/* bit i: pathdirs[i] holds this name */
+    struct tnode_t *kid;    /* first child */
+    struct tnode_t *next;   /* next sibling, siblings sorted by c */
+};
+struct tnode_t trie;        /* root of the PATH executable index */
+pthread_mutex_t trielock = PTHREAD_MUTEX_INITIALIZER;
+char *pathdirs[MAXPATHDIRS];/* PATH directories, in search order */
+int npathdirs;
+
+struct cands_t {            /* Tab completion candidates */
+    char **v;               /* text that replaces the word */
+    int n, cap;
+    size_t skip;            /* leading bytes not shown when listing */
+};
+
+struct tevent_t {           /* A recorded trace event */
+    const char *name;       /* what happened */
+    char ph;                /* 'X' for a span, 'i' for an instant */
+    long long ts;           /* start, in us on CLOCK_MONOTONIC */
+    long long dur;          /* span length in us */
+    pid_t pid;              /* child the event concerns, 0 for the shell */
+    int arg;                /* status, signal or errno */
+    char detail[64];        /* command line or path, truncated */
+};
+struct tevent_t *tracebuf;  /* trace events, NULL if tracing is off */
+unsigned int tracen;        /* slots of tracebuf handed out */
+char *tracefile;            /* where to write the trace on exit */
+int tracefd = -1;           /* child: reports a failed exec to Fork */
+pid_t shellpid;             /* pid of the shell itself, not its children */
+
+struct deadline_t {         /* A pending job deadline */
+    long long when;         /* ms on CLOCK_MONOTONIC */
+    pid_t pid;              /* job it applies to */
+    int sig;                /* SIGTERM, or SIGKILL after the grace period */
+};
+struct deadline_t dheap[MAXDEADLINES]; /* min-heap ordered by when */
+int ndeadlines;
+int timerfd = -1;           /* fires at dheap[0].when, -1 until needed */
+long long substdeadline;    /* when $(...) children of this line are
+                               killed, 0 for never */
 /* End global variables */
 
 
@@ -66,9 +185,42 @@ void sigtstp_handler(int sig);
 void sigint_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+int parseline(const char *cmdline, char ***argvp); 
+char *redirfile(const char *s);
 void sigquit_handler(int sig);
 
+char *expandsubst(const char *src, size_t len);
+char *capture(const char *cmd, size_t len, size_t limit);
+void substunmark(char *s);
+
+int globargs(char ***argvp, int argc, const char *quoted);
+int globcompile(const char *seg, struct gpat_t *g);
+int globmatch(const struct gpat_t *g, const char *s, size_t n);
+struct dlist_t *getdlist(const char *path);
+void putdlist(struct dlist_t *d);
+void dcacheflush(void);
+
+char *editline(char *buf, int size);
+void rawon(void);
+void rawoff(void);
+void startindexer(void);
+int triepath(const char *name, char *path, size_t size);
+
+long long tracenow(void);
+void tracespan(const char *name, long long start, pid_t pid, int arg,
+	       const char *detail);
+void traceevent(const char *name, pid_t pid, int arg, const char *detail);
+int writetrace(const char *file);
+void tracedump(void);
+
+long long parsedur(const char *s);
+char *fmtdur(long long ms, char *buf);
+long long nowms(void);
+void setdeadline(struct job_t *job, long long ms, long long when);
+void checkdeadlines(void);
+void waitinput(void);
+char *readcmd(char *buf, int size);
+
 void clearjob(struct job_t *job);
 void initjobs(struct job_t *jobs);
 int maxjid(struct job_t *jobs); 
@@ -85,6 +237,8 @@ void unix_error(char *msg);
 void app_error(char *msg);
 typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
+pid_t Fork(void);
+int Execv(const char *path, char *const argv[]);
 
 /*
  * main - The shell's main routine 
@@ -94,13 +248,15 @@ int main(int argc, char **argv)
     char c;
     char cmdline[MAXLINE];
     int emit_prompt = 1; /* emit prompt (default) */
+    int interactive;     /* read lines with the editor */
+    long long start;     /* trace timestamp */
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpt:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -111,6 +267,9 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 't':             /* record a trace of job events */
+            tracefile = optarg;
+	    break;
 	default:
             usage();
 	}
@@ -128,26 +287,57 @@ int main(int argc, char **argv)
 
     /* Initialize the job list */
     initjobs(jobs);
+    shellpid = getpid();
+
+    /* Set up the trace buffer, written out when the shell exits */
+    if (tracefile) {
+	if ((tracebuf = calloc(MAXTRACE, sizeof(struct tevent_t))) == NULL)
+	    unix_error("calloc error");
+	atexit(tracedump);
+    }
+
+    /* Use the line editor when someone is typing at a terminal, and
+     * index the PATH for command completion in the background */
+    interactive = emit_prompt && isatty(STDIN_FILENO) &&
+	tcgetattr(STDIN_FILENO, &cooked) == 0;
+    if (interactive) {
+	atexit(rawoff);
+	startindexer();
+    }
 
     /* Execute the shell's read/eval loop */
     while (1) {
 
 	/* Read command line */
-	if (emit_prompt) {
-	    printf("%s", prompt);
-	    fflush(stdout);
+	start = tracenow();
+	if (interactive) {
+	    if (editline(cmdline, MAXLINE) == NULL) { /* ctrl-d */
+		printf("\n");
+		fflush(stdout);
+		exit(0);
+	    }
 	}
-	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-	    app_error("fgets error");
-	if (feof(stdin)) { /* End of file (ctrl-d) */
-	    fflush(stdout);
-	    exit(0);
+	else {
+	    if (emit_prompt) {
+		printf("%s", prompt);
+		fflush(stdout);
+	    }
+	    if (readcmd(cmdline, MAXLINE) == NULL) { /* End of file (ctrl-d) */
+		fflush(stdout);
+		exit(0);
+	    }
 	}
 
+	tracespan("read", start, 0, 0, NULL);
+
 	/* Evaluate the command line */
+	start = tracenow();
 	eval(cmdline);
+	dcacheflush();
+	tracespan("eval", start, 0, 0, cmdline);
 	fflush(stdout);
 	fflush(stdout);
+	traceevent("prompt", 0, 0, NULL);
     } 
 
     exit(0); /* control never reaches here */
@@ -166,8 +356,54 @@ int main(int argc, char **argv)
 */
 void eval(char *cmdline) 
 {
-   char *argv[MAXARGS];
-   char *p = cmdline;
+   char **argv;
+   char *expanded = NULL; /* cmdline with every $(...) replaced */
+   char *p;
+   sigset_t mask, prev;   /* SIGCHLD stays blocked from fork to addjob */
+   long long timeout = 0; /* ms from a "timeout DURATION" prefix */
+   long long deadline = 0; /* when that runs out */
+   char dur[32];
+   size_t len;
+
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGCHLD);
+
+   for(p = cmdline; *p == ' '; p++)
+        ;
+   if(strncmp(p, "timeout ", 8) == 0) {
+        //"timeout DURATION cmd": cmd's substitutions and jobs all have
+        //to finish DURATION from now
+        for(p += 8; *p == ' '; p++)
+            ;
+        len = strcspn(p, " \r\n");
+        snprintf(dur, sizeof(dur), "%.*s", (int)len, p);
+        if(len >= sizeof(dur) || (timeout = parsedur(dur)) < 0) {
+            printf("timeout: invalid duration '%s'\n", dur);
+            return;
+        }
+        for(p += len; *p == ' '; p++)
+            ;
+        cmdline = p;
+        if(timeout)
+            deadline = nowms() + timeout;
+   }
+
+   if(strstr(cmdline, "$(")) {
+        //run the substitutions first so the rest of eval only sees words
+        substdeadline = deadline;
+        expanded = expandsubst(cmdline, strlen(cmdline));
+        substdeadline = 0;
+        if(expanded == NULL)
+            return;
+        cmdline = expanded;
+        if(deadline && nowms() >= deadline) {
+            //nothing left of the limit to run the command in
+            printf("timeout: %s used up by command substitution\n", dur);
+            free(expanded);
+            return;
+        }
+   }
+   p = cmdline;
 
    if(strchr(cmdline, '|')) {
         //there is a pipe charactar in this command
@@ -180,14 +416,15 @@ void eval(char *cmdline)
         pipe(fds);
 
         /* Now use parseline() to parse the two halfs of the command */
-        parseline(cmdline, argv);
+        parseline(cmdline, &argv);
         
-        if((pid1 = fork()) == 0) {
+        sigprocmask(SIG_BLOCK, &mask, &prev);
+        if((pid1 = Fork()) == 0) {
             //pre pipe call
             dup2(fds[1], 1);
             close(fds[1]);
             //exec...
-            if(execv(argv[0], argv) < 0) {
+            if(Execv(argv[0], argv) < 0) {
                 printf("Error, Unknown command");
                 exit(0);
             }
@@ -196,12 +433,12 @@ void eval(char *cmdline)
         close(fds[1]);
 
         //the reading part of the pipe
-        parseline(p, argv);
-        if((pid2 = fork()) == 0)  {
+        parseline(p, &argv);
+        if((pid2 = Fork()) == 0)  {
             //post pipe call
             dup2(fds[0], 0);
             //exec...
-            if(execv(argv[0], argv) < 0) {
+            if(Execv(argv[0], argv) < 0) {
               printf("Error, Unknown command");
               exit(0);
             }
@@ -209,145 +446,1604 @@ void eval(char *cmdline)
         //waitpid(pid2, NULL, 0);
 	    addjob(jobs, pid1, FG, cmdline); //adds a job to the job structure, the third arguement
 	    addjob(jobs, pid2, FG, cmdline); //adds a job to the job structure, the third arguement
+        if(timeout) {
+            setdeadline(getjobpid(jobs, pid1), timeout, deadline);
+            setdeadline(getjobpid(jobs, pid2), timeout, deadline);
+        }
+        sigprocmask(SIG_SETMASK, &prev, NULL);
 
         waitfg(pid1);
         waitfg(pid2);
        
    }
    else if (strchr(cmdline, '>')) {
-     char *argv[MAXARGS]; //for getting the argvs before the symbol
-     char *fname[MAXARGS]; //for getting the args after the synbol, which should just be the filename
-                           //it is kinda a hackish implimentation of getting the filename
+     char **argv; //for getting the argvs before the symbol
+     char *fname; //the filename after the symbol
      char *p = cmdline; 
      //redirect standard output
         strsep(&p, ">"); //the < char in the command line acts as a split where p has the contents after <
-        parseline(p, fname); //getting the filename
+        if((fname = redirfile(p)) == NULL) { //getting the filename
+            free(expanded);
+            return;
+        }
 
-        int fd = open(fname[0], O_CREAT|O_TRUNC|O_RDWR, 0644); //opening the file
+        int fd = open(fname, O_CREAT|O_TRUNC|O_RDWR, 0644); //opening the file
         pid_t pid1; //pid for the process that will be run in this case
-        parseline(cmdline, argv); //getting the command args before the carrot
+        parseline(cmdline, &argv); //getting the command args before the carrot
 
-        if((pid1 = fork()) == 0) { //creating the child process
+        sigprocmask(SIG_BLOCK, &mask, &prev);
+        if((pid1 = Fork()) == 0) { //creating the child process
             dup2(fd, 1); //changing standard Out to be the fd of the file above
-            if(execv(argv[0], argv) < 0) { //execting the file
+            if(Execv(argv[0], argv) < 0) { //execting the file
                 fprintf(stderr, "Error, Unknown command\n");
                 exit(0);
             }
         }
 
 	    addjob(jobs, pid1, FG, cmdline); //adds a job to the job structure, the third arguement
+        if(timeout)
+            setdeadline(getjobpid(jobs, pid1), timeout, deadline);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
         waitfg(pid1);
         close(fd);
    }
    else if (strchr(cmdline, '<')) {
-        char *argv[MAXARGS];
-        char *fname[MAXARGS]; //for getting the args after the synbol, which should just be the filename
+        char **argv;
+        char *fname; //the filename after the symbol
         
         char *p = cmdline;
         //redirect standard input
         strsep(&p, "<"); //the > char in the command line acts as a split where p has the contents after <
-        parseline(p, fname);
+        if((fname = redirfile(p)) == NULL) {
+            free(expanded);
+            return;
+        }
+
+        int fd = open(fname, O_RDONLY, 0644);
+        pid_t pid1; //pid for the child process that will run in this case
+        parseline(cmdline, &argv); //getting the command line args before the <
+
+        sigprocmask(SIG_BLOCK, &mask, &prev);
+        if((pid1 = Fork()) == 0) {
+            dup2(fd, 0); //changing standard input of the process to be the fd of the open file
+            if(Execv(argv[0], argv) < 0) {
+                fprintf(stderr, "Error, Unknown command\n");
+                exit(0);
+            }
+        }
+
+        addjob(jobs, pid1, FG, cmdline);
+        if(timeout)
+            setdeadline(getjobpid(jobs, pid1), timeout, deadline);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        waitfg(pid1);
+        close(fd);
+
+   } else {
+
+   int bg = parseline(cmdline, &argv);
+   pid_t pid;
+   if(argv[0] == NULL) {
+        free(expanded);
+        return;
+   } 
+    setpgrp();
+    if(builtin_cmd(argv)) {
+	if(timeout) //builtins run inside the shell, there is nothing to kill
+	    printf("timeout: ignored for builtin %s\n", argv[0]);
+    } else {
+	    //forking and execing a child process
+	    sigprocmask(SIG_BLOCK, &mask, &prev);
+	    if ((pid = Fork()) == 0) {
+	    	if(Execv(argv[0], argv) < 0) {
+	    		printf("Command Not Found!\n");
+	    		exit(0);
+	    	}
+	    }
+	    addjob(jobs, pid, bg?BG:FG, cmdline); //adds a job to the job structure, the third arguement
+					      //just sets the type to a FG/BG job depending on the value
+					      //of the variable bg
+	    if(timeout)
+	    	setdeadline(getjobpid(jobs, pid), timeout, deadline);
+	    sigprocmask(SIG_SETMASK, &prev, NULL);
+	    if(!bg) {
+	    	waitfg(pid);
+	    } else {
+	    	printf("Job [%d] (%d) %s", getjobpid(jobs, pid)->jid , pid, getjobpid(jobs, pid)->cmdline);
+	    }
+    } 
+   } 
+    free(expanded);
+    return;
+}
+
+/* 
+ * parseline - Parse the command line and build the argv array.
+ * 
+ * Characters enclosed in single quotes are treated as a single
+ * argument; other words containing *, ? or [...] are replaced by the
+ * paths they match (see globargs).  Return true if the user has requested a BG job, false if
+ * the user has requested a FG job.  
+ *
+ * *argvp is pointed at a NULL terminated array that, like the words
+ * in it, is only valid until the next call.
+ */
+int parseline(const char *cmdline, char ***argvp) 
+{
+    static char array[MAXEXPAND]; /* holds local copy of command line */
+    static char **argv;         /* argument list, grown as needed */
+    static char *quoted;        /* was argv[i] in single quotes? */
+    static int cap;             /* slots in argv and quoted */
+    char *buf = array;          /* ptr that traverses command line */
+    char *delim;                /* points to first space delimiter */
+    int argc;                   /* number of args */
+    int bg;                     /* background job? */
+    int q;                      /* is the current word quoted? */
+    int i;
+    void *tmp;
+    long long start = tracenow();
+
+    if (argv == NULL) {
+	cap = MAXARGS;
+	if ((argv = malloc(cap * sizeof(char *))) == NULL ||
+	    (quoted = malloc(cap)) == NULL)
+	    unix_error("malloc error");
+    }
+    *argvp = argv;
+
+    strcpy(buf, cmdline);
+    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
+    while (*buf && (*buf == ' ')) /* ignore leading spaces */
+	buf++;
+
+    /* Build the argv list */
+    argc = 0;
+    if ((q = (*buf == '\''))) {
+	buf++;
+	delim = strchr(buf, '\'');
+    }
+    else {
+	delim = strchr(buf, ' ');
+    }
+
+    while (delim) {
+	if (argc == cap - 1) {
+	    cap *= 2;
+	    if ((tmp = realloc(argv, cap * sizeof(char *))) == NULL)
+		unix_error("realloc error");
+	    *argvp = argv = tmp;
+	    if ((tmp = realloc(quoted, cap)) == NULL)
+		unix_error("realloc error");
+	    quoted = tmp;
+	}
+	quoted[argc] = q;
+	argv[argc++] = buf;
+	*delim = '\0';
+	buf = delim + 1;
+	while (*buf && (*buf == ' ')) /* ignore spaces */
+	       buf++;
+
+	if ((q = (*buf == '\''))) {
+	    buf++;
+	    delim = strchr(buf, '\'');
+	}
+	else {
+	    delim = strchr(buf, ' ');
+	}
+    }
+    argv[argc] = NULL;
+    tracespan("parse", start, 0, argc, cmdline);
+    
+    if (argc == 0)  /* ignore blank line */
+	return 1;
+
+    /* should the job run in the background? */
+    if ((bg = (*argv[argc-1] == '&')) != 0) {
+	argv[--argc] = NULL;
+    }
+
+    /* output of $(...) was marked so it could not act as syntax above;
+       from here on it is ordinary text */
+    for (i = 0; i < argc; i++)
+	substunmark(argv[i]);
+
+    /* expand unquoted *, ? and [...] words into the paths they match */
+    if (argc > 0 && (argc = globargs(argvp, argc, quoted)) < 0) {
+	argv[0] = NULL;
+	*argvp = argv;
+	return 1;
+    }
+    return bg;
+}
+
+/*
+ * redirfile - Return the file name at the start of s, the text after a
+ *    '>' or '<'. A glob there is only expanded if it names exactly one
+ *    path; otherwise print "ambiguous redirect" and return NULL. The
+ *    name is only valid until the next parseline().
+ */
+char *redirfile(const char *s)
+{
+    char **fname;
+    char *word;
+    size_t len, i;
+
+    while (*s == ' ')
+	s++;
+    len = strcspn(s, " \n");
+    for (i = 0; i < len && !strchr("*?[", s[i]); i++)
+	;
+    if (*s == '\'' || i == len) {      /* not a pattern */
+	parseline(s, &fname);
+	return fname[0];
+    }
+
+    /* expand the pattern on its own to see how many paths it names */
+    if ((word = malloc(len + 2)) == NULL)
+	unix_error("malloc error");
+    memcpy(word, s, len);
+    strcpy(word + len, "\n");
+    parseline(word, &fname);
+    free(word);
+    if (fname[0] != NULL && fname[1] != NULL) {
+	printf("%.*s: ambiguous redirect\n", (int)len, s);
+	return NULL;
+    }
+    return fname[0];
+}
+
+/*
+ * expandsubst - Replace every $(...) in the first len bytes of src with
+ *    the output of the command inside it.
+ *
+ * The output only gets word splitting and glob expansion: its
+ * SUBSTSPECIAL characters are replaced by marker bytes, so eval does
+ * not see them as pipes, redirects or '&', and parseline does not see
+ * quotes, until parseline puts them back with substunmark().
+ *
+ * Text in single quotes is copied through untouched. Nested
+ * substitutions are expanded by capture() in this process, so no
+ * extra shell is ever started. Returns a malloc'd, NUL terminated line
+ * no longer than MAXEXPAND, or NULL after printing an error.
+ */
+char *expandsubst(const char *src, size_t len)
+{
+    const char *p = src, *end = src + len;
+    const char *q, *e;
+    char *out, *sub;
+    size_t n = 0, sublen, i;
+    int depth;
+
+    if ((out = malloc(MAXEXPAND)) == NULL)
+	unix_error("malloc error");
+
+    while (p < end) {
+	if (*p == '\'' && (q = memchr(p + 1, '\'', end - p - 1)) != NULL) {
+	    q++;                        /* copy the quoted text as is */
+	}
+	else if (*p == '$' && p + 1 < end && p[1] == '(') {
+	    /* find the ')' that closes this substitution */
+	    depth = 1;
+	    for (q = p + 2; q < end; q++) {
+		if (*q == '\'' && (e = memchr(q + 1, '\'', end - q - 1)) != NULL)
+		    q = e;              /* a quoted ')' does not close it */
+		else if (*q == '$' && q + 1 < end && q[1] == '(') {
+		    depth++;
+		    q++;
+		}
+		else if (*q == ')' && --depth == 0)
+		    break;
+	    }
+	    if (q == end) {
+		printf("Unterminated $(\n");
+		free(out);
+		return NULL;
+	    }
+	    if ((sub = capture(p + 2, q - p - 2, MAXEXPAND - 1 - n)) == NULL) {
+		free(out);
+		return NULL;
+	    }
+	    sublen = strlen(sub);
+	    for (i = 0; i < sublen; i++) {
+		if ((e = strchr(SUBSTSPECIAL, sub[i])) != NULL)
+		    out[n++] = 1 + (e - SUBSTSPECIAL);
+		else
+		    out[n++] = sub[i];
+	    }
+	    free(sub);
+	    p = q + 1;
+	    continue;
+	}
+	else {
+	    q = p + 1;
+	}
+
+	if (n + (q - p) > MAXEXPAND - 1) {
+	    printf("Expanded command line is too long\n");
+	    free(out);
+	    return NULL;
+	}
+	memcpy(out + n, p, q - p);
+	n += q - p;
+	p = q;
+    }
+    out[n] = '\0';
+    return out;
+}
+
+/*
+ * capture - Run the command in the first len bytes of cmd and return
+ *    its standard output.
+ *
+ * The output is read through a pipe into a buffer that starts at
+ * SUBSTCHUNK bytes and doubles as needed, up to limit (and MAXSUBST)
+ * bytes; a child that writes more is killed. Trailing newlines are
+ * stripped and the remaining newlines, tabs, NULs and bytes that
+ * expandsubst() uses as markers become spaces so that parseline()
+ * splits the result into words. Returns a malloc'd string, or NULL
+ * after printing an error.
+ *
+ * The read and the wait for the child both sleep in poll, so job
+ * deadlines still fire meanwhile. Under "timeout" the child gets
+ * SIGTERM at substdeadline and SIGKILL KILLGRACE ms later, whether it
+ * is still writing or has closed its output, and the whole command is
+ * abandoned.
+ */
+char *capture(const char *cmd, size_t len, size_t limit)
+{
+    char **argv;
+    char *line, *buf, *tmp;
+    size_t n = 0, cap = SUBSTCHUNK, i;
+    ssize_t rc;
+    int fds[2];
+    pid_t pid;
+    sigset_t mask, prev;
+    long long start, now, killat = substdeadline;
+    int sig = SIGTERM, wait, timedout = 0;
+    int eof = 0, reaped = 0, pidfd = -1, nfds, pipei, timeri;
+    struct pollfd pfd[3];
+
+    if (limit > MAXSUBST)
+	limit = MAXSUBST;
+    if (cap > limit)
+	cap = limit + 1;            /* one spare byte detects overflow */
+
+    /* expand nested substitutions, then split into argv */
+    if ((line = expandsubst(cmd, len)) == NULL)
+	return NULL;
+    n = strlen(line);
+    if ((tmp = realloc(line, n + 2)) == NULL)
+	unix_error("realloc error");
+    line = tmp;
+    strcpy(line + n, "\n");    /* parseline expects a trailing newline */
+    parseline(line, &argv);
+    free(line);
+    n = 0;
+
+    if ((buf = malloc(cap + 1)) == NULL)
+	unix_error("malloc error");
+    if (argv[0] == NULL) {
+	buf[0] = '\0';
+	return buf;
+    }
+
+    /* keep sigchld_handler from reaping the child before we do */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    start = tracenow();
+    if (pipe(fds) < 0)
+	unix_error("pipe error");
+    if ((pid = Fork()) == 0) {
+	close(fds[0]);
+	dup2(fds[1], 1);
+	close(fds[1]);
+	if (Execv(argv[0], argv) < 0) {
+	    fprintf(stderr, "Command Not Found!\n");
+	    exit(0);
+	}
+    }
+    close(fds[1]);
+
+    /* a pidfd wakes poll when the child exits, even with SIGCHLD blocked */
+#ifdef SYS_pidfd_open
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+
+    /* read to EOF and reap the child, both bounded by killat */
+    while (!eof || !reaped) {
+	if (!reaped && waitpid(pid, NULL, WNOHANG) == pid)
+	    reaped = 1;
+	if (eof && reaped)
+	    break;
+	if (!eof && n == cap) {
+	    if (cap > limit) {
+		printf("Command substitution output exceeds %lu bytes\n",
+		       (unsigned long)limit);
+		if (!reaped)
+		    kill(pid, SIGKILL);
+		free(buf);
+		buf = NULL;
+		eof = 1;
+		continue;
+	    }
+	    cap *= 2;
+	    if (cap > limit)
+		cap = limit + 1;        /* one spare byte detects overflow */
+	    if ((tmp = realloc(buf, cap + 1)) == NULL)
+		unix_error("realloc error");
+	    buf = tmp;
+	}
+
+	wait = -1;
+	if (killat) {
+	    now = nowms();
+	    if (now >= killat) {
+		timedout = 1;
+		if (!reaped) {
+		    kill(pid, sig);
+		    traceevent("timeout", pid, sig, argv[0]);
+		}
+		if (sig == SIGKILL || reaped) {
+		    /* don't wait on whoever else holds the pipe */
+		    if (!reaped)
+			waitpid(pid, NULL, 0);
+		    break;
+		}
+		sig = SIGKILL;
+		killat = now + KILLGRACE;
+		continue;
+	    }
+	    wait = killat - now > INT_MAX ? INT_MAX : killat - now;
+	}
+
+	nfds = 0;
+	pipei = timeri = -1;
+	if (!eof) {
+	    pipei = nfds;
+	    pfd[nfds].fd = fds[0];
+	    pfd[nfds++].events = POLLIN;
+	}
+	if (timerfd >= 0) {
+	    timeri = nfds;
+	    pfd[nfds].fd = timerfd;
+	    pfd[nfds++].events = POLLIN;
+	}
+	if (!reaped && pidfd >= 0) {
+	    pfd[nfds].fd = pidfd;
+	    pfd[nfds++].events = POLLIN;
+	}
+	else if (!reaped && eof && (wait < 0 || wait > 10))
+	    wait = 10;          /* no pidfd: look in on the child */
+	if (poll(pfd, nfds, wait) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("poll error");
+	}
+	if (timeri >= 0 && pfd[timeri].revents)
+	    checkdeadlines();
+	if (pipei < 0 || pfd[pipei].revents == 0)
+	    continue;
+	if ((rc = read(fds[0], buf + n, cap - n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("read error");
+	}
+	if (rc == 0)
+	    eof = 1;
+	n += rc;
+    }
+    close(fds[0]);
+    if (pidfd >= 0)
+	close(pidfd);
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    tracespan("subst", start, pid, n, argv[0]);
+
+    if (timedout && buf != NULL) {
+	printf("Command substitution %s timed out\n", argv[0]);
+	free(buf);
+	buf = NULL;
+    }
+    if (buf == NULL)
+	return NULL;
+    while (n > 0 && buf[n-1] == '\n')
+	n--;
+    for (i = 0; i < n; i++)
+	if (buf[i] == '\n' || buf[i] == '\t' || buf[i] == '\r' ||
+	    (unsigned char)buf[i] <= sizeof(SUBSTSPECIAL) - 1)
+	    buf[i] = ' ';
+    buf[n] = '\0';
+    return buf;
+}
+
+/* substunmark - Turn expandsubst()'s marker bytes back into text */
+void substunmark(char *s)
+{
+    for (; *s; s++)
+	if ((unsigned char)*s < sizeof(SUBSTSPECIAL))
+	    *s = SUBSTSPECIAL[*s - 1];
+}
+
+/*****************************
+ * Glob expansion routines
+ *****************************/
+
+struct gblock_t {            /* A block of storage for globbed words */
+    struct gblock_t *next;
+    size_t used, size;
+    char buf[];
+};
+static struct gblock_t *globpool; /* words of the last globargs() */
+static char **globv;             /* the argv globargs() builds */
+static size_t globcap;           /* slots in globv */
+
+struct gstate_t {           /* State of one globargs() expansion */
+    struct gpat_t *pat;     /* compiled path components */
+    int npat;
+    int dirsonly;           /* pattern ended in '/' */
+    int base, n;            /* matches are globv[base..base+n-1] */
+    long room;              /* bytes of ARG_MAX not yet used */
+    int full;               /* the matches would exceed ARG_MAX */
+};
+
+struct linux_dirent64 {     /* record layout returned by getdents64 */
+    uint64_t d_ino;         /* fixed width: ino_t/off_t shrink on ILP32 */
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* setend - Return the ']' closing the bracket expression at p, or NULL */
+static const char *setend(const char *p)
+{
+    p++;
+    if (*p == '!' || *p == '^')
+	p++;
+    if (*p == ']')              /* a leading ']' is a member */
+	p++;
+    while (*p && *p != ']')
+	p++;
+    return *p ? p : NULL;
+}
+
+/*
+ * globcompile - Compile one '/'-free path component into g.
+ *
+ * Runs of ordinary bytes become single GT_LIT tokens that are compared
+ * with memcmp, consecutive stars collapse into one, and [...] becomes
+ * a 256 bit set. A leading and a trailing literal are split off into
+ * g->head and g->tail so most names are rejected by two memcmps.
+ * Returns the kind stored in g->kind.
+ */
+int globcompile(const char *seg, struct gpat_t *g)
+{
+    const char *p = seg, *end;
+    struct gtok_t *t;
+    int c, lo, hi, neg, i;
+
+    memset(g, 0, sizeof(*g));
+    g->dot = (seg[0] == '.');
+    if (strcmp(seg, "**") == 0)
+	return g->kind = 2;
+    if (!strpbrk(seg, "*?[")) {
+	g->head = seg;
+	g->headlen = strlen(seg);
+	return g->kind = 0;
+    }
+
+    if ((g->tok = malloc((strlen(seg) + 1) * sizeof(struct gtok_t))) == NULL)
+	unix_error("malloc error");
+    while (*p) {
+	t = &g->tok[g->ntok];
+	if (*p == '*') {
+	    while (*p == '*')
+		p++;
+	    t->type = GT_STAR;
+	}
+	else if (*p == '?') {
+	    p++;
+	    t->type = GT_ONE;
+	}
+	else if (*p == '[' && (end = setend(p)) != NULL) {
+	    t->type = GT_SET;
+	    memset(t->set, 0, sizeof(t->set));
+	    p++;
+	    if ((neg = (*p == '!' || *p == '^')))
+		p++;
+	    do {
+		lo = hi = (unsigned char)*p++;
+		if (*p == '-' && p + 1 < end) {
+		    hi = (unsigned char)p[1];
+		    p += 2;
+		}
+		for (c = lo; c <= hi; c++)
+		    t->set[c >> 3] |= 1 << (c & 7);
+	    } while (p < end);
+	    if (neg)
+		for (i = 0; i < 32; i++)
+		    t->set[i] = ~t->set[i];
+	    p = end + 1;
+	}
+	else {
+	    t->type = GT_LIT;
+	    t->lit = p;
+	    while (*p && *p != '*' && *p != '?' && !(*p == '[' && setend(p)))
+		p++;
+	    t->len = p - t->lit;
+	}
+	g->ntok++;
+    }
+
+    if (g->tok[0].type == GT_LIT) {
+	g->head = g->tok[0].lit;
+	g->headlen = g->tok[0].len;
+	memmove(g->tok, g->tok + 1, --g->ntok * sizeof(struct gtok_t));
+    }
+    if (g->ntok > 0 && g->tok[g->ntok-1].type == GT_LIT) {
+	g->ntok--;
+	g->tail = g->tok[g->ntok].lit;
+	g->taillen = g->tok[g->ntok].len;
+    }
+    return g->kind = 1;
+}
+
+/*
+ * globmatch - Return true if the n byte name s matches g.
+ *
+ * Tokens are matched left to right; on a mismatch only the most
+ * recent star is widened, so the cost is bounded by the name length
+ * times the pattern length rather than exponential. When that star is
+ * followed by a literal, memmem jumps straight to its next occurrence.
+ */
+int globmatch(const struct gpat_t *g, const char *s, size_t n)
+{
+    const struct gtok_t *k;
+    const char *hit;
+    size_t i = 0, mark = 0;
+    int t = 0, star = -1;
+
+    if (n < g->headlen + g->taillen)
+	return 0;
+    if (memcmp(s, g->head, g->headlen) != 0 ||
+	memcmp(s + n - g->taillen, g->tail, g->taillen) != 0)
+	return 0;
+    s += g->headlen;
+    n -= g->headlen + g->taillen;
+
+    while (1) {
+	if (t == g->ntok) {
+	    if (i == n || star == g->ntok)
+		return 1;
+	}
+	else if ((k = &g->tok[t])->type == GT_STAR) {
+	    star = ++t;
+	    mark = i;
+	    continue;
+	}
+	else if (k->type == GT_LIT) {
+	    if (n - i >= k->len && memcmp(s + i, k->lit, k->len) == 0) {
+		i += k->len;
+		t++;
+		continue;
+	    }
+	}
+	else if (i < n && (k->type == GT_ONE ||
+			   (k->set[(unsigned char)s[i] >> 3] &
+			    (1 << ((unsigned char)s[i] & 7))))) {
+	    i++;
+	    t++;
+	    continue;
+	}
+
+	/* mismatch: let the last star swallow one more byte */
+	if (star < 0 || mark >= n)
+	    return 0;
+	mark++;
+	if (star < g->ntok && g->tok[star].type == GT_LIT) {
+	    k = &g->tok[star];
+	    if ((hit = memmem(s + mark, n - mark, k->lit, k->len)) == NULL)
+		return 0;
+	    mark = hit - s;
+	}
+	i = mark;
+	t = star;
+    }
+}
+
+/*
+ * readdlist - Read every entry of the open directory fd into d, in
+ *    DIRBUFSZ batches of getdents64 records. "." and ".." are skipped.
+ *    Returns 0, or -1 with errno set if the directory can't be read.
+ */
+static int readdlist(int fd, struct dlist_t *d)
+{
+    static long dirbuf[(DIRBUFSZ) / sizeof(long)];
+    struct linux_dirent64 *de;
+    long nread, off;
+    size_t len;
+    void *tmp;
+
+    d->nbytes = d->nents = 0;
+    while ((nread = syscall(SYS_getdents64, fd, dirbuf, sizeof(dirbuf))) > 0) {
+	for (off = 0; off < nread; off += de->d_reclen) {
+	    de = (struct linux_dirent64 *)((char *)dirbuf + off);
+	    if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+		(de->d_name[1] == '.' && de->d_name[2] == '\0')))
+		continue;
+	    len = strlen(de->d_name);
+
+	    if (d->nbytes + len + 1 > d->namecap) {
+		d->namecap = d->namecap ? d->namecap * 2 : DIRBUFSZ;
+		if (d->namecap < d->nbytes + len + 1)
+		    d->namecap = d->nbytes + len + 1;
+		if ((tmp = realloc(d->names, d->namecap)) == NULL)
+		    unix_error("realloc error");
+		d->names = tmp;
+	    }
+	    if (d->nents == d->entcap) {
+		d->entcap = d->entcap ? d->entcap * 2 : 1024;
+		if ((tmp = realloc(d->ents, d->entcap * sizeof(struct dent_t))) == NULL)
+		    unix_error("realloc error");
+		d->ents = tmp;
+	    }
+	    d->ents[d->nents].off = d->nbytes;
+	    d->ents[d->nents].len = len;
+	    d->ents[d->nents].type = de->d_type;
+	    d->nents++;
+	    memcpy(d->names + d->nbytes, de->d_name, len + 1);
+	    d->nbytes += len + 1;
+	}
+    }
+    return nread < 0 ? -1 : 0;
+}
+
+/*
+ * getdlist - Return the listing of directory path ("" is the current
+ *    directory), pinned until putdlist().
+ *
+ * Listings are cached in dcache by device and inode and reused for as
+ * long as the directory's mtime is unchanged, so a line such as
+ * "*.log *.gz" reads a large directory only once. The cache lasts for
+ * one command line (see dcacheflush).
+ * A directory modified in the last two seconds is not trusted on the
+ * next lookup, since a change within the mtime granularity would not
+ * be seen. Returns NULL if path cannot be opened as a directory.
+ */
+struct dlist_t *getdlist(const char *path)
+{
+    struct dlist_t *d = NULL, *victim = NULL;
+    struct stat st;
+    struct timespec now;
+    int fd, i;
+
+    if ((fd = open(*path ? path : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
+	return NULL;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return NULL;
+    }
+
+    for (i = 0; i < MAXDCACHE; i++) {
+	d = &dcache[i];
+	if (d->used && d->dev == st.st_dev && d->ino == st.st_ino)
+	    break;
+    }
+    if (i < MAXDCACHE) {
+	if (d->valid && d->mtime.tv_sec == st.st_mtim.tv_sec &&
+	    d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+	    close(fd);
+	    d->pins++;
+	    d->used = ++dclock;
+	    return d;
+	}
+	if (d->pins == 0)
+	    victim = d;         /* stale: refresh it in place */
+    }
+    else {
+	for (i = 0; i < MAXDCACHE; i++) {
+	    d = &dcache[i];
+	    if (d->pins == 0 && (victim == NULL || d->used < victim->used))
+		victim = d;
+	}
+    }
+    if (victim == NULL) {       /* every slot is being walked */
+	if ((victim = calloc(1, sizeof(struct dlist_t))) == NULL)
+	    unix_error("calloc error");
+	victim->heap = 1;
+    }
+
+    victim->dev = st.st_dev;
+    victim->ino = st.st_ino;
+    victim->mtime = st.st_mtim;
+    clock_gettime(CLOCK_REALTIME, &now);
+    victim->valid = (now.tv_sec - st.st_mtim.tv_sec >= 2);
+    if (readdlist(fd, victim) < 0) {
+	printf("%s: %s\n", *path ? path : ".", strerror(errno));
+	close(fd);
+	victim->used = 0;       /* never hand out a partial listing */
+	victim->valid = 0;
+	victim->pins++;
+	putdlist(victim);
+	return NULL;
+    }
+    close(fd);
+    victim->pins++;
+    victim->used = ++dclock;
+    return victim;
+}
+
+/* putdlist - Release a listing returned by getdlist */
+void putdlist(struct dlist_t *d)
+{
+    if (d->heap) {
+	free(d->names);
+	free(d->ents);
+	free(d);
+	return;
+    }
+    d->pins--;
+}
+
+/*
+ * isdir - Is path (whose getdents64 type is type) a directory? Symbolic
+ *    links are followed only if follow is set.
+ */
+static int isdir(const char *path, int type, int follow)
+{
+    struct stat st;
+
+    if (type == DT_DIR)
+	return 1;
+    if (type != DT_UNKNOWN && !(type == DT_LNK && follow))
+	return 0;
+    if ((follow ? stat(path, &st) : lstat(path, &st)) < 0)
+	return 0;
+    return S_ISDIR(st.st_mode);
+}
+
+/*
+ * dcacheflush - Free every cached listing. Called after each command
+ *    line so one huge directory doesn't stay resident in the shell.
+ */
+void dcacheflush(void)
+{
+    struct dlist_t *d;
+    int i;
+
+    for (i = 0; i < MAXDCACHE; i++) {
+	d = &dcache[i];
+	if (d->pins)
+	    continue;
+	free(d->names);
+	free(d->ents);
+	memset(d, 0, sizeof(*d));
+    }
+}
+
+/* globput - Append word to globv, growing it as needed */
+static void globput(int n, char *word)
+{
+    void *tmp;
+
+    if (n + 1 >= globcap) {
+	globcap = globcap ? globcap * 2 : MAXARGS;
+	if ((tmp = realloc(globv, globcap * sizeof(char *))) == NULL)
+	    unix_error("realloc error");
+	globv = tmp;
+    }
+    globv[n] = word;
+}
+
+/*
+ * globalloc - Return n bytes from globpool. Blocks are never moved, so
+ *    words stay put as more are added; they are freed by the next
+ *    globargs().
+ */
+static char *globalloc(size_t n)
+{
+    struct gblock_t *b = globpool;
+    size_t size;
+
+    if (b == NULL || b->used + n > b->size) {
+	size = n > GLOBCHUNK ? n : GLOBCHUNK;
+	if ((b = malloc(sizeof(struct gblock_t) + size)) == NULL)
+	    unix_error("malloc error");
+	b->next = globpool;
+	b->used = 0;
+	b->size = size;
+	globpool = b;
+    }
+    b->used += n;
+    return b->buf + b->used - n;
+}
+
+/* globadd - Append the len byte path to the matches of gs */
+static void globadd(struct gstate_t *gs, const char *path, size_t len, int type)
+{
+    int slash = gs->dirsonly;
+    char *word;
+
+    if (slash && !isdir(path, type, 1))
+	return;
+    gs->room -= len + slash + 1 + sizeof(char *);
+    if (gs->room < 0) {
+	gs->full = 1;
+	return;
+    }
+    word = globalloc(len + slash + 1);
+    memcpy(word, path, len);
+    if (slash)
+	word[len++] = '/';
+    word[len] = '\0';
+    globput(gs->base + gs->n++, word);
+}
+
+/*
+ * globwalk - Match components si.. of the pattern below the directory
+ *    prefix held in the first plen bytes of path (PATH_MAX bytes).
+ */
+static void globwalk(struct gstate_t *gs, char *path, size_t plen, int si)
+{
+    struct gpat_t *g = &gs->pat[si];
+    struct dlist_t *d;
+    struct dent_t *e;
+    struct stat st;
+    const char *name;
+    int last = (si == gs->npat - 1);
+    size_t i, len;
+
+    if (gs->full)
+	return;
+
+    if (g->kind == 0) {         /* literal component, no listing needed */
+	len = g->headlen;
+	if (plen + len + 2 > PATH_MAX)
+	    return;
+	memcpy(path + plen, g->head, len + 1);
+	if (!last) {
+	    path[plen + len] = '/';
+	    globwalk(gs, path, plen + len + 1, si + 1);
+	}
+	else if (lstat(path, &st) == 0)
+	    globadd(gs, path, plen + len, DT_UNKNOWN);
+	return;
+    }
+    if (g->kind == 2 && !last)  /* ** also matches zero directories */
+	globwalk(gs, path, plen, si + 1);
+
+    path[plen] = '\0';
+    if ((d = getdlist(path)) == NULL)
+	return;
+    for (i = 0; i < d->nents && !gs->full; i++) {
+	e = &d->ents[i];
+	name = d->names + e->off;
+	len = e->len;
+	if (name[0] == '.' && !g->dot)
+	    continue;
+	if (g->kind == 1 && !globmatch(g, name, len))
+	    continue;
+	if (plen + len + 2 > PATH_MAX)
+	    continue;
+	memcpy(path + plen, name, len + 1);
+
+	if (g->kind == 2) {     /* descend without following symlinks */
+	    if (last)
+		globadd(gs, path, plen + len, e->type);
+	    if (isdir(path, e->type, 0)) {
+		path[plen + len] = '/';
+		globwalk(gs, path, plen + len + 1, si);
+	    }
+	}
+	else if (last)
+	    globadd(gs, path, plen + len, e->type);
+	else if (isdir(path, e->type, 1)) {
+	    path[plen + len] = '/';
+	    globwalk(gs, path, plen + len + 1, si + 1);
+	}
+    }
+    putdlist(d);
+}
+
+static int globcmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * globargs - Replace each unquoted word of *argvp that contains *, ?
+ *    or [...] with the sorted list of paths it matches.
+ *
+ * "**" as a whole component matches any number of directories. Names
+ * starting with '.' only match a component that starts with '.'. A
+ * word that matches nothing is passed on as typed. The new argument
+ * list may hold as many words as execve() accepts (ARG_MAX bytes of
+ * words and pointers); *argvp is pointed at it. Returns the new argc,
+ * or -1 (after printing an error) if the matches would not fit.
+ */
+int globargs(char ***argvp, int argc, const char *quoted)
+{
+    char **argv = *argvp;
+    char path[PATH_MAX];
+    char *pat, *seg, *next;
+    struct gstate_t gs;
+    struct gblock_t *b;
+    int i, j, n = 0;
+    size_t plen;
+    long room;
+    long long start;
+
+    while ((b = globpool) != NULL) {  /* the last command's words */
+	globpool = b->next;
+	free(b);
+    }
+    if ((room = sysconf(_SC_ARG_MAX)) <= 0)
+	room = MAXSUBST;
+
+    for (i = 0; i < argc; i++) {
+	if (quoted[i] || !strpbrk(argv[i], "*?[")) {
+	    room -= strlen(argv[i]) + 1 + sizeof(char *);
+	    globput(n++, argv[i]);
+	    continue;
+	}
+
+	/* split the word into components and compile each one */
+	if ((pat = strdup(argv[i])) == NULL)
+	    unix_error("strdup error");
+	memset(&gs, 0, sizeof(gs));
+	if ((gs.pat = malloc((strlen(pat) / 2 + 2) * sizeof(struct gpat_t))) == NULL)
+	    unix_error("malloc error");
+	plen = 0;
+	if (pat[0] == '/')
+	    path[plen++] = '/';
+	for (seg = pat; seg; seg = next) {
+	    if ((next = strchr(seg, '/')) != NULL)
+		*next++ = '\0';
+	    if (*seg == '\0') {
+		if (next == NULL)
+		    gs.dirsonly = 1;
+		continue;
+	    }
+	    globcompile(seg, &gs.pat[gs.npat++]);
+	}
+
+	gs.base = n;
+	gs.room = room;
+	start = tracenow();
+	if (gs.npat > 0)
+	    globwalk(&gs, path, plen, 0);
+	tracespan("glob", start, 0, gs.n, argv[i]);
+	for (j = 0; j < gs.npat; j++)
+	    free(gs.pat[j].tok);
+	free(gs.pat);
+	free(pat);
+
+	if (gs.full) {
+	    printf("Too many matches for %s (over ARG_MAX, %ld bytes)\n",
+		   argv[i], sysconf(_SC_ARG_MAX));
+	    return -1;
+	}
+	if (gs.n == 0) {        /* no match: keep the word as typed */
+	    room -= strlen(argv[i]) + 1 + sizeof(char *);
+	    globput(n++, argv[i]);
+	    continue;
+	}
+	qsort(globv + n, gs.n, sizeof(char *), globcmp);
+	n += gs.n;
+	room = gs.room;
+    }
+
+    globput(n, NULL);
+    *argvp = globv;
+    return n;
+}
+
+/*************************************
+ * Line editor and completion routines
+ *************************************/
+
+/* rawon - Put the terminal in raw mode for the line editor */
+void rawon(void)
+{
+    struct termios raw = cooked;
+
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) == 0)
+	rawmode = 1;
+}
+
+/* rawoff - Give the terminal back its original settings */
+void rawoff(void)
+{
+    if (rawmode) {
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+	rawmode = 0;
+    }
+}
+
+/*
+ * trienode - Return the trie node for name, creating the path to it if
+ *    create is set. The caller holds trielock.
+ */
+static struct tnode_t *trienode(const char *name, int create)
+{
+    struct tnode_t *n = &trie, **pp, *k;
+    unsigned char c;
+
+    for (; *name; name++) {
+	c = *name;
+	for (pp = &n->kid; *pp && (*pp)->c < c; pp = &(*pp)->next)
+	    ;
+	if (*pp == NULL || (*pp)->c != c) {
+	    if (!create)
+		return NULL;
+	    if ((k = calloc(1, sizeof(struct tnode_t))) == NULL)
+		unix_error("calloc error");
+	    k->c = c;
+	    k->next = *pp;
+	    *pp = k;
+	}
+	n = *pp;
+    }
+    return n;
+}
+
+/* trieset - Record whether pathdirs[i] holds an executable called name */
+static void trieset(const char *name, int i, int on)
+{
+    struct tnode_t *n;
+
+    pthread_mutex_lock(&trielock);
+    if ((n = trienode(name, on)) != NULL) {
+	if (on)
+	    n->dirs |= 1ULL << i;
+	else
+	    n->dirs &= ~(1ULL << i);
+    }
+    pthread_mutex_unlock(&trielock);
+}
+
+/* trieclear - Drop the dirs in mask from n, its siblings and children */
+static void trieclear(struct tnode_t *n, unsigned long long mask)
+{
+    for (; n; n = n->next) {
+	n->dirs &= ~mask;
+	trieclear(n->kid, mask);
+    }
+}
+
+/*
+ * triepath - Write the full path PATH lookup would use for name into
+ *    path. Returns 0 if name is not in the index.
+ */
+int triepath(const char *name, char *path, size_t size)
+{
+    struct tnode_t *n;
+    int found = 0;
+
+    pthread_mutex_lock(&trielock);
+    if ((n = trienode(name, 0)) != NULL && n->dirs) {
+	snprintf(path, size, "%s/%s", pathdirs[__builtin_ctzll(n->dirs)], name);
+	found = 1;
+    }
+    pthread_mutex_unlock(&trielock);
+    return found;
+}
+
+/* isexec - Is dir/name a regular file with an execute bit set? */
+static int isexec(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+	(st.st_mode & 0111);
+}
+
+/* indexdir - Add every executable in pathdirs[i] to the trie */
+static void indexdir(int i)
+{
+    DIR *dp;
+    struct dirent *de;
+
+    if ((dp = opendir(pathdirs[i])) == NULL)
+	return;
+    while ((de = readdir(dp)) != NULL) {
+	if (de->d_name[0] == '.' || de->d_type == DT_DIR)
+	    continue;
+	if (isexec(pathdirs[i], de->d_name))
+	    trieset(de->d_name, i, 1);
+    }
+    closedir(dp);
+}
+
+/*
+ * indexer - Thread that builds the executable trie and then keeps it
+ *    current from inotify events on the PATH directories, so that
+ *    completion never has to rescan them.
+ *
+ * PATH entries that are the same directory (/bin -> /usr/bin on a
+ * merged /usr) share one watch descriptor, so each event is applied to
+ * every entry with that descriptor. If the event queue overflows, all
+ * the directories are scanned again.
+ */
+static void *indexer(void *arg)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    int wd[MAXPATHDIRS];
+    int fd, i, found;
+    ssize_t n;
+    char *p;
+
+    fd = inotify_init1(IN_CLOEXEC);
+    for (i = 0; i < npathdirs; i++) {
+	/* watch first so nothing added during the scan is missed */
+	wd[i] = fd < 0 ? -1 : inotify_add_watch(fd, pathdirs[i],
+	    IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM |
+	    IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+	indexdir(i);
+    }
+    if (fd < 0)
+	return NULL;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+	for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+	    ev = (const struct inotify_event *)p;
+	    if (ev->mask & IN_Q_OVERFLOW) {
+		/* events were lost: rebuild each watched directory */
+		for (i = 0; i < npathdirs; i++) {
+		    if (wd[i] < 0)
+			continue;
+		    pthread_mutex_lock(&trielock);
+		    trieclear(trie.kid, 1ULL << i);
+		    pthread_mutex_unlock(&trielock);
+		    indexdir(i);
+		}
+		continue;
+	    }
+	    for (i = 0, found = -1; i < npathdirs; i++) {
+		if (wd[i] != ev->wd || ev->wd < 0)
+		    continue;
+		if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+		    pthread_mutex_lock(&trielock);
+		    trieclear(trie.kid, 1ULL << i);
+		    pthread_mutex_unlock(&trielock);
+		    found = i;  /* keep matching the aliases */
+		}
+		else if (ev->len == 0 || ev->name[0] == '.')
+		    continue;
+		else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+		    trieset(ev->name, i, 0);
+		else
+		    trieset(ev->name, i, isexec(pathdirs[i], ev->name));
+	    }
+	    if (found >= 0)
+		for (i = 0; i < npathdirs; i++)
+		    if (wd[i] == ev->wd)
+			wd[i] = -1;
+	}
+    }
+    close(fd);
+    return NULL;
+}
+
+/*
+ * startindexer - Split PATH into pathdirs and start the indexer thread
+ *    with every signal blocked, so the shell's handlers only ever run
+ *    on the main thread.
+ */
+void startindexer(void)
+{
+    char *path, *dir;
+    pthread_t tid;
+    sigset_t all, prev;
+    int i;
+
+    if ((path = getenv("PATH")) == NULL || (path = strdup(path)) == NULL)
+	return;
+    while ((dir = strsep(&path, ":")) != NULL && npathdirs < MAXPATHDIRS) {
+	if (*dir == '\0')
+	    continue;
+	for (i = 0; i < npathdirs && strcmp(pathdirs[i], dir) != 0; i++)
+	    ;
+	if (i == npathdirs)
+	    pathdirs[npathdirs++] = dir;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+    if (pthread_create(&tid, NULL, indexer, NULL) == 0)
+	pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+}
 
-        int fd = open(fname[0], O_RDONLY, 0644);
-        pid_t pid1; //pid for the child process that will run in this case
-        parseline(cmdline, argv); //getting the command line args before the <
+/* candadd - Append a copy of s to the candidates */
+static void candadd(struct cands_t *cs, const char *s)
+{
+    char **tmp;
 
-        if((pid1 = fork()) == 0) {
-            dup2(fd, 0); //changing standard input of the process to be the fd of the open file
-            if(execv(argv[0], argv) < 0) {
-                fprintf(stderr, "Error, Unknown command\n");
-                exit(0);
-            }
-        }
+    if (cs->n == cs->cap) {
+	cs->cap = cs->cap ? cs->cap * 2 : 64;
+	if ((tmp = realloc(cs->v, cs->cap * sizeof(char *))) == NULL)
+	    unix_error("realloc error");
+	cs->v = tmp;
+    }
+    if ((cs->v[cs->n++] = strdup(s)) == NULL)
+	unix_error("strdup error");
+}
 
-        addjob(jobs, pid1, FG, cmdline);
-        waitfg(pid1);
-        close(fd);
+/* triecollect - Add every indexed name below n; name holds its prefix */
+static void triecollect(struct tnode_t *n, char *name, size_t len,
+			struct cands_t *cs)
+{
+    struct tnode_t *k;
 
-   } else {
+    if (n->dirs) {
+	name[len] = '\0';
+	candadd(cs, name);
+    }
+    if (len == NAME_MAX)
+	return;
+    for (k = n->kid; k; k = k->next) {
+	name[len] = k->c;
+	triecollect(k, name, len + 1, cs);
+    }
+}
 
-   int bg = parseline(cmdline, argv);
-   pid_t pid;
-   if(argv[0] == NULL) {
-        return;
-   } 
-    setpgrp();
-    if(!builtin_cmd(argv)) {
-	    //forking and execing a child process
-	    if ((pid = fork()) == 0) {
-	    	if(execv(argv[0], argv) < 0) {
-	    		printf("Command Not Found!\n");
-	    		exit(0);
-	    	}
-	    }
-	    addjob(jobs, pid, bg?BG:FG, cmdline); //adds a job to the job structure, the third arguement
-					      //just sets the type to a FG/BG job depending on the value
-					      //of the variable bg
-	    if(!bg) {
-	    	waitfg(pid);
-	    } else {
-	    	printf("Job [%d] (%d) %s", getjobpid(jobs, pid)->jid , pid, cmdline);
-	    }
-    } 
-   } 
-    return;
+/* filecands - Add the paths that complete word */
+static void filecands(const char *word, struct cands_t *cs)
+{
+    char dir[PATH_MAX], full[PATH_MAX];
+    const char *slash = strrchr(word, '/');
+    const char *base;
+    size_t dlen = slash ? slash - word + 1 : 0;
+    size_t blen;
+    DIR *dp;
+    struct dirent *de;
+
+    memcpy(dir, word, dlen);
+    dir[dlen] = '\0';
+    base = word + dlen;
+    blen = strlen(base);
+    cs->skip = dlen;
+    if ((dp = opendir(dlen ? dir : ".")) == NULL)
+	return;
+    while ((de = readdir(dp)) != NULL) {
+	if (strncmp(de->d_name, base, blen) != 0 ||
+	    (de->d_name[0] == '.' && base[0] != '.') ||
+	    strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	    continue;
+	if (dlen + strlen(de->d_name) + 2 > sizeof(full))
+	    continue;
+	strcpy(full, dir);
+	strcat(full, de->d_name);
+	if (isdir(full, de->d_type, 1))
+	    strcat(full, "/");
+	candadd(cs, full);
+    }
+    closedir(dp);
 }
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
+/* jobcands - Add the %jid of every job that completes word */
+static void jobcands(const char *word, struct cands_t *cs)
+{
+    char id[16];
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid == 0)
+	    continue;
+	sprintf(id, "%%%d", jobs[i].jid);
+	if (strncmp(id, word, strlen(word)) == 0)
+	    candadd(cs, id);
+    }
+}
+
+static int candcmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * complete - Complete the word that ends at the cursor.
+ *
+ * "%..." completes job IDs, the first word of a command (with no '/')
+ * completes from the executable trie and is replaced by its full path
+ * once unique, and anything else completes file names. Several
+ * candidates are extended to their longest common prefix, or listed
+ * if there is none to add.
  */
-int parseline(const char *cmdline, char **argv) 
+static void complete(char *buf, int *lenp, int *posp, int size)
 {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
-    int bg;                     /* background job? */
+    struct cands_t cs;
+    struct tnode_t *n;
+    char word[MAXLINE], name[NAME_MAX + 1], path[PATH_MAX];
+    const char *text;
+    int start, wlen, tlen, i, cmd, space = 0;
+
+    for (start = *posp; start > 0 && buf[start-1] != ' '; start--)
+	;
+    wlen = *posp - start;
+    memcpy(word, buf + start, wlen);
+    word[wlen] = '\0';
+    for (i = start; i > 0 && buf[i-1] == ' '; i--)
+	;
+    cmd = (i == 0 || buf[i-1] == '|') && word[0] != '%' && !strchr(word, '/');
+
+    memset(&cs, 0, sizeof(cs));
+    if (word[0] == '%')
+	jobcands(word, &cs);
+    else if (cmd) {
+	pthread_mutex_lock(&trielock);
+	if (wlen <= NAME_MAX && (n = trienode(word, 0)) != NULL) {
+	    memcpy(name, word, wlen);
+	    triecollect(n, name, wlen, &cs);
+	}
+	pthread_mutex_unlock(&trielock);
+    }
+    else
+	filecands(word, &cs);
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-	buf++;
+    if (cs.n == 0) {
+	text = NULL;
+    }
+    else if (cs.n == 1) {
+	text = cs.v[0];
+	if (cmd && triepath(text, path, sizeof(path)))
+	    text = path;
+	tlen = strlen(text);
+	space = (text[tlen-1] != '/');
+    }
+    else {
+	qsort(cs.v, cs.n, sizeof(char *), candcmp);
+	text = cs.v[0];         /* sorted, so first and last bound the LCP */
+	for (tlen = 0; text[tlen] && text[tlen] == cs.v[cs.n-1][tlen]; tlen++)
+	    ;
+	if (tlen <= wlen) {
+	    printf("\n");
+	    for (i = 0; i < cs.n && i < MAXLISTED; i++)
+		printf("%s  ", cs.v[i] + cs.skip);
+	    if (cs.n > MAXLISTED)
+		printf("... (%d more)", cs.n - MAXLISTED);
+	    printf("\n");
+	    fflush(stdout);
+	    text = word;
+	    tlen = wlen;
+	}
+    }
 
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-	buf++;
-	delim = strchr(buf, '\'');
+    if (text == NULL || *lenp - wlen + tlen + space > size - 2) {
+	write(STDOUT_FILENO, "\a", 1);
     }
     else {
-	delim = strchr(buf, ' ');
+	memmove(buf + start + tlen + space, buf + *posp, *lenp - *posp);
+	memcpy(buf + start, text, tlen);
+	if (space)
+	    buf[start + tlen] = ' ';
+	*lenp += tlen + space - wlen;
+	*posp = start + tlen + space;
     }
 
-    while (delim) {
-	argv[argc++] = buf;
-	*delim = '\0';
-	buf = delim + 1;
-	while (*buf && (*buf == ' ')) /* ignore spaces */
-	       buf++;
+    for (i = 0; i < cs.n; i++)
+	free(cs.v[i]);
+    free(cs.v);
+}
 
-	if (*buf == '\'') {
-	    buf++;
-	    delim = strchr(buf, '\'');
-	}
-	else {
-	    delim = strchr(buf, ' ');
+/* refresh - Redraw the prompt and line with the cursor at pos */
+static void refresh(const char *buf, int len, int pos)
+{
+    char out[MAXLINE + 64];
+    int n;
+
+    n = snprintf(out, sizeof(out), "\r%s%.*s\x1b[K", prompt, len, buf);
+    if (pos < len)
+	n += snprintf(out + n, sizeof(out) - n, "\x1b[%dD", len - pos);
+    write(STDOUT_FILENO, out, n);
+}
+
+/*
+ * editline - Read a command line from the terminal in raw mode.
+ *
+ * Supports the arrow keys, home/end, backspace/delete, ctrl-a, ctrl-e,
+ * ctrl-u, ctrl-c (discard the line) and tab completion. Returns buf,
+ * ending in '\n' like fgets, or NULL on ctrl-d at an empty line.
+ */
+char *editline(char *buf, int size)
+{
+    int len = 0, pos = 0;
+    char c, seq[2];
+    ssize_t rc;
+
+    fflush(stdout);
+    rawon();
+    refresh(buf, len, pos);
+    while (1) {
+	waitinput();
+	if ((rc = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR)
+	    continue;
+	if (rc <= 0) {
+	    rawoff();
+	    return NULL;
 	}
-    }
-    argv[argc] = NULL;
-    
-    if (argc == 0)  /* ignore blank line */
-	return 1;
 
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {
-	argv[--argc] = NULL;
+	switch (c) {
+	case '\r':
+	case '\n':
+	    refresh(buf, len, len);
+	    write(STDOUT_FILENO, "\n", 1);
+	    buf[len++] = '\n';
+	    buf[len] = '\0';
+	    rawoff();
+	    return buf;
+	case 4:                 /* ctrl-d */
+	    if (len == 0) {
+		rawoff();
+		return NULL;
+	    }
+	    if (pos < len) {
+		memmove(buf + pos, buf + pos + 1, len - pos - 1);
+		len--;
+	    }
+	    break;
+	case 3:                 /* ctrl-c */
+	    write(STDOUT_FILENO, "^C\n", 3);
+	    len = pos = 0;
+	    break;
+	case 127:               /* backspace */
+	case 8:
+	    if (pos > 0) {
+		memmove(buf + pos - 1, buf + pos, len - pos);
+		pos--;
+		len--;
+	    }
+	    break;
+	case 1:                 /* ctrl-a */
+	    pos = 0;
+	    break;
+	case 5:                 /* ctrl-e */
+	    pos = len;
+	    break;
+	case 21:                /* ctrl-u */
+	    memmove(buf, buf + pos, len - pos);
+	    len -= pos;
+	    pos = 0;
+	    break;
+	case '\t':
+	    complete(buf, &len, &pos, size);
+	    break;
+	case 27:                /* escape sequence */
+	    if (read(STDIN_FILENO, seq, 1) != 1 || seq[0] != '[' ||
+		read(STDIN_FILENO, seq + 1, 1) != 1)
+		break;
+	    if (seq[1] == 'C' && pos < len)
+		pos++;
+	    else if (seq[1] == 'D' && pos > 0)
+		pos--;
+	    else if (seq[1] == 'H')
+		pos = 0;
+	    else if (seq[1] == 'F')
+		pos = len;
+	    else if (seq[1] == '3' && read(STDIN_FILENO, seq, 1) == 1 &&
+		     seq[0] == '~' && pos < len) {
+		memmove(buf + pos, buf + pos + 1, len - pos - 1);
+		len--;
+	    }
+	    break;
+	default:
+	    if ((unsigned char)c >= ' ' && len < size - 2) {
+		memmove(buf + pos + 1, buf + pos, len - pos);
+		buf[pos++] = c;
+		len++;
+	    }
+	}
+	refresh(buf, len, pos);
     }
-    return bg;
 }
 
 /* 
@@ -374,6 +2070,13 @@ int builtin_cmd(char **argv)
 	listjobs(jobs);
 	return 1;
     }
+    else if (strcmp("trace", argv[0]) == 0) {
+	if (!tracebuf)
+	    printf("Tracing is off, start tsh with -t <file>\n");
+	else if (writetrace(argv[1] ? argv[1] : tracefile) == 0)
+	    printf("Wrote trace to %s\n", argv[1] ? argv[1] : tracefile);
+	return 1;
+    }
     return 0;     /* not a builtin command */
 }
 
@@ -394,7 +2097,9 @@ int stringToInt(char *str) {
 
 
 /* 
- * do_bgfg - Execute the builtin bg and fg commands
+ * do_bgfg - Execute the builtin bg and fg commands. An optional
+ *    DURATION after the job ("fg %1 30s") gives it a new deadline,
+ *    counted from now; 0 removes the deadline.
  */
 void do_bgfg(char **argv) 
 {
@@ -402,6 +2107,11 @@ void do_bgfg(char **argv)
     pid_t PID;
     struct job_t * JOB;
     int isFG;
+    long long timeout = -1; //optional deadline, -1 keeps the current one
+    if(argv[1] && argv[2] && (timeout = parsedur(argv[2])) < 0) {
+	printf("%s: invalid duration '%s'\n", argv[0], argv[2]);
+	return;
+    }
     if(strcmp("fg", argv[0]) == 0) {
 	isFG = 1;
 	if(argv[1] &&  argv[1][0] == '%') {
@@ -437,7 +2147,10 @@ void do_bgfg(char **argv)
 	}
     }
     if(JOB) {
+	if(timeout >= 0)
+		setdeadline(JOB, timeout, nowms() + timeout);
 	kill(JOB->pid, SIGCONT);
+	traceevent("continue", JOB->pid, isFG ? FG : BG, NULL);
 	if(!isFG) {
 		JOB->state = BG;
 		printf("Job [%d] (%d) %s", JOB->jid, JOB->pid, JOB->cmdline);
@@ -458,9 +2171,23 @@ void do_bgfg(char **argv)
  */
 void waitfg(pid_t pid)
 {
+    long long start = tracenow();
+    sigset_t mask, prev;
+    struct pollfd pfd;
+
+    /* ppoll unblocks SIGCHLD only while asleep, so a reap can't slip
+       in between the fgpid check and the wait */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
     while (fgpid(jobs) == pid) {
-	sleep(1);
+	pfd.fd = timerfd;
+	pfd.events = POLLIN;
+	if (ppoll(&pfd, timerfd < 0 ? 0 : 1, NULL, &prev) > 0)
+	    checkdeadlines();
     }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    tracespan("waitfg", start, pid, 0, NULL);
 }
 
 /*****************
@@ -479,7 +2206,20 @@ void sigchld_handler(int sig)
    // kill(0, SIGINT);
     //pid_t pid = wait(NULL); //reap a single child. Bad implementation
     pid_t pid;  
-    while((pid = waitpid((pid_t)(-1), 0, WNOHANG)) > 0) {
+    int status;
+    struct job_t *job;
+    char dur[32];
+    while((pid = waitpid((pid_t)(-1), &status, WNOHANG)) > 0) {
+    	traceevent("reap", pid, status, NULL);
+    	if((job = getjobpid(jobs, pid)) && job->timedout) {
+    	    fmtdur(job->timeout, dur);
+    	    if(WIFSIGNALED(status))
+    	    	printf("Job [%d] (%d) Timed out after %s, terminated by signal %d\n",
+    	    	       job->jid, pid, dur, WTERMSIG(status));
+    	    else
+    	    	printf("Job [%d] (%d) Timed out after %s, exited with status %d\n",
+    	    	       job->jid, pid, dur, WEXITSTATUS(status));
+    	}
     	deletejob(jobs, pid);
     }
     return;
@@ -496,6 +2236,7 @@ void sigint_handler(int sig)
     pid_t pid;
     if(!(pid = fgpid(jobs)) == 0) {
 	int jobID = getjobpid(jobs, pid)->pid;
+	traceevent("interrupt", pid, SIGINT, NULL);
 	if(deletejob(jobs, pid) == 1) {
 		//printf("Job killed\n");
 		printf("Job [%d] (%d) Terminated by signal 2\n", jobID, pid);//, getjobpid(jobs, pid)->jid , pid);
@@ -521,6 +2262,7 @@ void sigtstp_handler(int sig)
      JOB = getjobpid(jobs, pid);
      JOB->state = ST;
      kill(pid, SIGTSTP);
+     traceevent("stop", pid, SIGTSTP, NULL);
     printf("Job [%d] (%d) Terminated by signal 20\n", JOB->jid , pid);
     //} else {
 //	printf("No fg Job to stop %d \n", pid);
@@ -546,6 +2288,9 @@ void clearjob(struct job_t *job) {
     job->jid = 0;
     job->state = UNDEF;
     job->cmdline[0] = '\0';
+    job->timeout = 0;
+    job->deadline = 0;
+    job->timedout = 0;
 }
 
 /* initjobs - Initialize the job list */
@@ -582,7 +2327,10 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
 	    jobs[i].jid = nextjid++;
 	    if (nextjid > MAXJOBS)
 		nextjid = 1;
-	    strcpy(jobs[i].cmdline, cmdline);
+	    strncpy(jobs[i].cmdline, cmdline, MAXLINE-1);
+	    jobs[i].cmdline[MAXLINE-1] = '\0';
+	    substunmark(jobs[i].cmdline); /* show $(...) output as text */
+	    traceevent("addjob", pid, jobs[i].jid, jobs[i].cmdline);
   	    if(verbose){
 	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
             }
@@ -665,6 +2413,7 @@ int pid2jid(pid_t pid)
 void listjobs(struct job_t *jobs) 
 {
     int i;
+    char dur[32];
     
     for (i = 0; i < MAXJOBS; i++) {
 	if (jobs[i].pid != 0) {
@@ -683,6 +2432,10 @@ void listjobs(struct job_t *jobs)
 		    printf("listjobs: Internal error: job[%d].state=%d ", 
 			   i, jobs[i].state);
 	    }
+	    if (jobs[i].timedout)
+		printf("(timed out after %s) ", fmtdur(jobs[i].timeout, dur));
+	    else if (jobs[i].timeout)
+		printf("(timeout %s) ", fmtdur(jobs[i].timeout, dur));
 	    printf("%s", jobs[i].cmdline);
 	}
     }
@@ -692,6 +2445,412 @@ void listjobs(struct job_t *jobs)
  ******************************/
 
 
+/********************
+ * Deadline routines
+ ********************/
+
+/* nowms - Milliseconds on the monotonic clock */
+long long nowms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * parsedur - Parse a duration like "1.5", "300ms", "10s", "2m", "1h"
+ *     or "1d" (plain numbers are seconds). Returns ms, or -1 if bad.
+ */
+long long parsedur(const char *s)
+{
+    char *end;
+    double v, unit;
+
+    errno = 0;
+    v = strtod(s, &end);
+    if (end == s || errno || !(v >= 0))
+	return -1;
+    if (*end == '\0' || strcmp(end, "s") == 0)
+	unit = 1000;
+    else if (strcmp(end, "ms") == 0)
+	unit = 1;
+    else if (strcmp(end, "m") == 0)
+	unit = 60 * 1000;
+    else if (strcmp(end, "h") == 0)
+	unit = 60 * 60 * 1000;
+    else if (strcmp(end, "d") == 0)
+	unit = 24 * 60 * 60 * 1000;
+    else
+	return -1;
+    if (v * unit > 1e15)        /* ~30000 years, keeps the sums in range */
+	return -1;
+    return (long long)(v * unit + 0.5);
+}
+
+/* fmtdur - Format ms in the largest unit that divides it evenly */
+char *fmtdur(long long ms, char *buf)
+{
+    if (ms > 0 && ms % (60 * 60 * 1000) == 0)
+	sprintf(buf, "%lldh", ms / (60 * 60 * 1000));
+    else if (ms > 0 && ms % (60 * 1000) == 0)
+	sprintf(buf, "%lldm", ms / (60 * 1000));
+    else if (ms % 1000 == 0)
+	sprintf(buf, "%llds", ms / 1000);
+    else
+	sprintf(buf, "%lldms", ms);
+    return buf;
+}
+
+/*
+ * dlive - Is heap entry d still wanted? Entries are never removed when
+ *     a job ends or gets a new deadline, they just stop matching it.
+ */
+static int dlive(const struct deadline_t *d)
+{
+    struct job_t *job = getjobpid(jobs, d->pid);
+
+    if (job == NULL)
+	return 0;
+    if (d->sig == SIGKILL)
+	return job->timedout == 1;
+    return job->timedout == 0 && job->timeout > 0 && job->deadline == d->when;
+}
+
+/* dpush - Add an entry to the deadline heap */
+static void dpush(long long when, pid_t pid, int sig)
+{
+    struct deadline_t d, tmp[MAXDEADLINES];
+    int i, n;
+
+    if (ndeadlines == MAXDEADLINES) {
+	/* full of stale entries: rebuild with just the live ones */
+	memcpy(tmp, dheap, sizeof(dheap));
+	n = ndeadlines;
+	ndeadlines = 0;
+	for (i = 0; i < n; i++)
+	    if (dlive(&tmp[i]))
+		dpush(tmp[i].when, tmp[i].pid, tmp[i].sig);
+	if (ndeadlines == MAXDEADLINES) {
+	    app_error("dpush: deadline heap full");
+	}
+    }
+
+    d.when = when;
+    d.pid = pid;
+    d.sig = sig;
+    for (i = ndeadlines++; i > 0 && dheap[(i-1)/2].when > when; i = (i-1)/2)
+	dheap[i] = dheap[(i-1)/2];
+    dheap[i] = d;
+}
+
+/* dpop - Remove the earliest entry from the deadline heap */
+static void dpop(void)
+{
+    struct deadline_t last = dheap[--ndeadlines];
+    int i = 0, c;
+
+    while ((c = 2*i + 1) < ndeadlines) {
+	if (c + 1 < ndeadlines && dheap[c+1].when < dheap[c].when)
+	    c++;
+	if (dheap[c].when >= last.when)
+	    break;
+	dheap[i] = dheap[c];
+	i = c;
+    }
+    dheap[i] = last;
+}
+
+/* armtimer - Point the timerfd at the earliest live deadline */
+static void armtimer(void)
+{
+    struct itimerspec its;
+
+    while (ndeadlines > 0 && !dlive(&dheap[0]))
+	dpop();
+    memset(&its, 0, sizeof(its));
+    if (ndeadlines > 0) {
+	its.it_value.tv_sec = dheap[0].when / 1000;
+	its.it_value.tv_nsec = (dheap[0].when % 1000) * 1000000;
+    }
+    if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+	unix_error("timerfd_settime error");
+}
+
+/*
+ * setdeadline - Give job until when (ms on CLOCK_MONOTONIC) to finish,
+ *     replacing any earlier deadline; ms is the limit that came from,
+ *     and 0 removes it. One timerfd covers every job, set to go off
+ *     at the earliest deadline in the heap.
+ */
+void setdeadline(struct job_t *job, long long ms, long long when)
+{
+    sigset_t mask, prev;
+
+    if (job == NULL)
+	return;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    if (timerfd < 0 &&
+	(timerfd = timerfd_create(CLOCK_MONOTONIC,
+				  TFD_CLOEXEC | TFD_NONBLOCK)) < 0)
+	unix_error("timerfd_create error");
+    job->timeout = ms;
+    job->deadline = ms ? when : 0;
+    job->timedout = 0;
+    if (ms)
+	dpush(job->deadline, job->pid, SIGTERM);
+    armtimer();
+    traceevent("deadline", job->pid, (int)(ms > INT_MAX ? INT_MAX : ms),
+	       NULL);
+
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * checkdeadlines - Signal every job whose deadline has passed. A job
+ *     gets SIGTERM (and SIGCONT, in case it is stopped), then SIGKILL
+ *     if it is still around KILLGRACE ms later.
+ */
+void checkdeadlines(void)
+{
+    sigset_t mask, prev;
+    uint64_t expirations;
+    struct deadline_t d;
+    struct job_t *job;
+    long long now;
+
+    if (timerfd < 0)
+	return;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    read(timerfd, &expirations, sizeof(expirations));
+    now = nowms();
+    while (ndeadlines > 0 && dheap[0].when <= now) {
+	d = dheap[0];
+	dpop();
+	if (!dlive(&d))
+	    continue;
+	job = getjobpid(jobs, d.pid);
+	if (d.sig == SIGTERM) {
+	    kill(d.pid, SIGTERM);
+	    kill(d.pid, SIGCONT);
+	    job->timedout = 1;
+	    dpush(now + KILLGRACE, d.pid, SIGKILL);
+	}
+	else {
+	    kill(d.pid, SIGKILL);
+	    job->timedout = 2;
+	}
+	traceevent("timeout", d.pid, d.sig, NULL);
+    }
+    armtimer();
+
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * waitinput - Block until stdin is readable, handling any deadlines
+ *     that come due in the meantime.
+ */
+void waitinput(void)
+{
+    struct pollfd pfd[2];
+
+    if (timerfd < 0)
+	return;
+    pfd[0].fd = STDIN_FILENO;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = timerfd;
+    pfd[1].events = POLLIN;
+    while (1) {
+	if (poll(pfd, 2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("poll error");
+	}
+	if (pfd[1].revents)
+	    checkdeadlines();
+	if (pfd[0].revents)
+	    return;
+    }
+}
+
+/*
+ * readcmd - fgets for a non-terminal stdin, except that it waits in
+ *     poll so deadlines still fire while the shell sits at the prompt.
+ *     Returns NULL at end of file, dropping an unterminated last line
+ *     the way the fgets/feof loop did.
+ */
+char *readcmd(char *buf, int size)
+{
+    static char ibuf[MAXLINE];
+    static int ilen, eof;
+    char *nl;
+    int n;
+
+    while (1) {
+	nl = memchr(ibuf, '\n', ilen);
+	if (nl != NULL || ilen >= size - 1) {
+	    n = nl ? nl - ibuf + 1 : size - 1;
+	    memcpy(buf, ibuf, n);
+	    buf[n] = '\0';
+	    memmove(ibuf, ibuf + n, ilen - n);
+	    ilen -= n;
+	    return buf;
+	}
+	if (eof)
+	    return NULL;
+	waitinput();
+	if ((n = read(STDIN_FILENO, ibuf + ilen, sizeof(ibuf) - ilen)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    app_error("read error");
+	}
+	if (n == 0)
+	    eof = 1;
+	ilen += n;
+    }
+}
+
+/*******************
+ * Tracing routines
+ *******************/
+
+/* tracenow - Microseconds on the monotonic clock, 0 if tracing is off */
+long long tracenow(void)
+{
+    struct timespec ts;
+
+    if (!tracebuf)
+	return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * traceadd - Fill in the next free slot of tracebuf. Slots are handed
+ *    out with an atomic add, so the signal handlers can record events
+ *    without blocking signals in the main loop. Events past MAXTRACE
+ *    are dropped and counted.
+ */
+static void traceadd(const char *name, char ph, long long ts, long long dur,
+		     pid_t pid, int arg, const char *detail)
+{
+    struct tevent_t *e;
+    unsigned int i;
+    size_t n = 0;
+
+    if (!tracebuf)
+	return;
+    if ((i = __atomic_fetch_add(&tracen, 1, __ATOMIC_RELAXED)) >= MAXTRACE)
+	return;
+    e = &tracebuf[i];
+    if (detail) {
+	for (n = 0; n < sizeof(e->detail) - 1 && detail[n]; n++)
+	    e->detail[n] = detail[n];
+	while (n > 0 && (e->detail[n-1] == '\n' || e->detail[n-1] == '\r'))
+	    n--;
+    }
+    e->detail[n] = '\0';
+    e->ph = ph;
+    e->ts = ts;
+    e->dur = dur;
+    e->pid = pid;
+    e->arg = arg;
+    e->name = name;
+}
+
+/* tracespan - Record a span that began at start and ends now */
+void tracespan(const char *name, long long start, pid_t pid, int arg,
+	       const char *detail)
+{
+    if (tracebuf)
+	traceadd(name, 'X', start, tracenow() - start, pid, arg, detail);
+}
+
+/* traceevent - Record an instant event */
+void traceevent(const char *name, pid_t pid, int arg, const char *detail)
+{
+    if (tracebuf)
+	traceadd(name, 'i', tracenow(), 0, pid, arg, detail);
+}
+
+/* jsonstr - Write s to fp as a JSON string literal */
+static void jsonstr(FILE *fp, const char *s)
+{
+    putc('"', fp);
+    for (; *s; s++) {
+	if (*s == '"' || *s == '\\')
+	    fprintf(fp, "\\%c", *s);
+	else if ((unsigned char)*s < ' ')
+	    fprintf(fp, "\\u%04x", (unsigned char)*s);
+	else
+	    putc(*s, fp);
+    }
+    putc('"', fp);
+}
+
+/*
+ * writetrace - Write the recorded events to file in the Chrome trace
+ *    event format, which chrome://tracing and Perfetto load directly.
+ *    Shell work is on the shell's own track and each job gets a track
+ *    named after its command line. Returns 0 on success.
+ */
+int writetrace(const char *file)
+{
+    FILE *fp;
+    struct tevent_t *e;
+    unsigned int i, n = tracen < MAXTRACE ? tracen : MAXTRACE;
+
+    if ((fp = fopen(file, "w")) == NULL) {
+	printf("%s: %s\n", file, strerror(errno));
+	return -1;
+    }
+    fprintf(fp, "{\"traceEvents\":[\n"
+	    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+	    "\"args\":{\"name\":\"tsh\"}}", shellpid, shellpid);
+    for (i = 0; i < n; i++) {
+	e = &tracebuf[i];
+	if (e->name == NULL)    /* slot still being filled */
+	    continue;
+	if (strcmp(e->name, "addjob") == 0) {
+	    fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		    "\"tid\":%d,\"args\":{\"name\":", shellpid, e->pid);
+	    jsonstr(fp, e->detail);
+	    fprintf(fp, "}}");
+	}
+	fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"tsh\",\"ph\":\"%c\","
+		"\"ts\":%lld,", e->name, e->ph, e->ts);
+	if (e->ph == 'X')
+	    fprintf(fp, "\"dur\":%lld,", e->dur);
+	else
+	    fprintf(fp, "\"s\":\"t\",");
+	fprintf(fp, "\"pid\":%d,\"tid\":%d,\"args\":{\"pid\":%d,\"arg\":%d",
+		shellpid, e->pid ? e->pid : shellpid, e->pid, e->arg);
+	if (e->detail[0]) {
+	    fprintf(fp, ",\"detail\":");
+	    jsonstr(fp, e->detail);
+	}
+	fprintf(fp, "}}");
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\","
+	    "\"otherData\":{\"dropped\":%u}}\n", tracen - n);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* tracedump - atexit hook that writes the trace given with -t */
+void tracedump(void)
+{
+    if (getpid() == shellpid)   /* not in a child that failed to exec */
+	writetrace(tracefile);
+}
+
+
 /***********************
  * Other helper routines
  ***********************/
@@ -701,10 +2860,11 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvp] [-t file]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -t f write a Chrome/Perfetto trace of job events to file f\n");
     exit(1);
 }
 
@@ -742,6 +2902,64 @@ handler_t *Signal(int signum, handler_t *handler)
     return (old_action.sa_handler);
 }
 
+/*
+ * Fork - wrapper for the fork function
+ *
+ * The child starts with SIGCHLD unblocked, since callers block it
+ * until the new job is on the job list. When tracing, the parent also
+ * waits on a close-on-exec pipe that Execv writes errno to on failure,
+ * so it can record when, and whether, the child's exec happened.
+ */
+pid_t Fork(void)
+{
+    int fds[2] = {-1, -1};
+    int err = 0;
+    long long start = tracenow();
+    pid_t pid;
+    sigset_t mask;
+
+    if (tracebuf && pipe2(fds, O_CLOEXEC) < 0)
+	fds[0] = fds[1] = -1;
+    if ((pid = fork()) < 0)
+	unix_error("Fork error");
+    if (pid == 0) {
+	/* the shell may have SIGCHLD blocked; its children must not */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	if (fds[0] >= 0)
+	    close(fds[0]);
+	tracefd = fds[1];
+	return 0;
+    }
+
+    tracespan("fork", start, pid, 0, NULL);
+    if (fds[0] >= 0) {
+	close(fds[1]);
+	while (read(fds[0], &err, sizeof(err)) < 0 && errno == EINTR)
+	    ;
+	close(fds[0]);
+	traceevent(err ? "exec failed" : "exec", pid, err, NULL);
+    }
+    return pid;
+}
+
+/*
+ * Execv - wrapper for the execv function that reports a failure to
+ *    the tracing parent (see Fork). Only returns on failure.
+ */
+int Execv(const char *path, char *const argv[])
+{
+    int err;
+
+    execv(path, argv);
+    err = errno;
+    if (tracefd >= 0)
+	write(tracefd, &err, sizeof(err));
+    errno = err;
+    return -1;
+}
+
 /*
  * sigquit_handler - The driver program can gracefully terminate the
  *    child shell by sending it a SIGQUIT signal.